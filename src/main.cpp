@@ -1,8 +1,27 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/quaternion.hpp>
@@ -35,6 +54,45 @@ struct MotionData {
 	std::vector<FrameData> frameDatas;
 };
 
+// Where a conversion reports to. In the pipeline several files are converted at once, so details are optional.
+struct LogContext {
+	std::string bvhFilename;
+	bool verbose = true;
+};
+
+// Output file, which is preallocated and written at explicit offsets.
+// Unless it was closed successfully, the file is deleted on destruction, so no broken output is left behind.
+struct BinaryFile {
+#if defined(__linux__)
+	int fd = -1;
+#else
+	std::ofstream file;
+#endif
+	std::string filename;
+	size_t fileSize = 0;
+	bool complete = false;
+	// If set, the time spent in file operations is added.
+	int64_t* writeMicroseconds = nullptr;
+
+	BinaryFile() = default;
+	BinaryFile(const BinaryFile&) = delete;
+	BinaryFile& operator=(const BinaryFile&) = delete;
+	~BinaryFile();
+};
+
+struct BinaryFileTimer {
+	BinaryFile& binaryFile;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	~BinaryFileTimer()
+	{
+		if (binaryFile.writeMicroseconds)
+		{
+			*binaryFile.writeMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+};
+
 //
 
 std::string trim(const std::string& s)
@@ -63,7 +121,7 @@ std::string trim(const std::string& s)
 
 //
 
-bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteData, const glm::mat4& parentMatrix, HierarchyData& hierarchyData, size_t& offset, const std::vector<std::string>& bvhLines)
+bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteData, const glm::mat4& parentMatrix, HierarchyData& hierarchyData, size_t& offset, const std::vector<std::string>& bvhLines, const LogContext& logContext)
 {
 	glm::mat4 currentMatrix = parentMatrix;
 
@@ -84,7 +142,7 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 			hierarchyData.nodeDatas.push_back(NodeData());
 
 			offset++;
-			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines))
+			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -109,7 +167,7 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 			hierarchyData.nodeDatas.push_back(NodeData());
 
 			offset++;
-			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines))
+			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -132,7 +190,7 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 			hierarchyData.nodeDatas.push_back(NodeData());
 
 			offset++;
-			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines))
+			if (!generateHierarchy(glTF, childNodeIndex, byteData, currentMatrix, hierarchyData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -141,7 +199,10 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 		{
 			offset++;
 
-			printf("Info: Entering node '%s'\n", glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str());
+			if (logContext.verbose)
+			{
+				printf("Info: %s: Entering node '%s'\n", logContext.bvhFilename.c_str(), glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str());
+			}
 		}
 		else if (line.rfind("OFFSET", 0) == 0)
 		{
@@ -161,7 +222,10 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 
 			currentMatrix = parentMatrix * glm::translate(glm::mat4(1.0f), glm::vec3(x, y, z));
 
-			printf("Info: Node '%s' has offsets %f %f %f\n", glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str(), x, y, z);
+			if (logContext.verbose)
+			{
+				printf("Info: %s: Node '%s' has offsets %f %f %f\n", logContext.bvhFilename.c_str(), glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str(), x, y, z);
+			}
 		}
 		else if (line.rfind("CHANNELS", 0) == 0)
 		{
@@ -174,7 +238,10 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 			{
 				if (currentToken == 1)
 				{
-					printf("Info: Node '%s' has %s channels\n", glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str(), token.c_str());
+					if (logContext.verbose)
+					{
+						printf("Info: %s: Node '%s' has %s channels\n", logContext.bvhFilename.c_str(), glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str(), token.c_str());
+					}
 				}
 				else if (currentToken >= 2)
 				{
@@ -188,7 +255,7 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 					}
 					else
 					{
-						printf("Unknown (HIERARCHY) token '%s'\n", token.c_str());
+						printf("Error: Unknown (HIERARCHY) token '%s' in '%s'\n", token.c_str(), logContext.bvhFilename.c_str());
 						return false;
 					}
 				}
@@ -207,12 +274,15 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 			memcpy(byteData.data() + offset, glm::value_ptr(inverseMatrix), 16 * sizeof(float));
 
 			// Leave node
-			printf("Info: Leaving node '%s'\n", glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str());
+			if (logContext.verbose)
+			{
+				printf("Info: %s: Leaving node '%s'\n", logContext.bvhFilename.c_str(), glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str());
+			}
 			return true;
 		}
 		else
 		{
-			printf("Error: Unknown in HIERARCHY '%s'\n", line.c_str());
+			printf("Error: Unknown in HIERARCHY '%s' in '%s'\n", line.c_str(), logContext.bvhFilename.c_str());
 			return false;
 		}
 	}
@@ -220,7 +290,7 @@ bool generateHierarchy(json& glTF, size_t nodeIndex, std::vector<uint8_t>& byteD
 	return true;
 }
 
-bool gatherSamples(MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines)
+bool gatherSamples(MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines, const LogContext& logContext)
 {
 	size_t currentFrame = 0;
 
@@ -238,14 +308,17 @@ bool gatherSamples(MotionData& motionData, size_t& offset, const std::vector<std
 		{
 			motionData.frameDatas[currentFrame].values.push_back(std::stof(token));
 		}
-		printf("Info: Frame %zu has %zu samples\n", currentFrame, motionData.frameDatas[currentFrame].values.size());
+		if (logContext.verbose)
+		{
+			printf("Info: %s: Frame %zu has %zu samples\n", logContext.bvhFilename.c_str(), currentFrame, motionData.frameDatas[currentFrame].values.size());
+		}
 		currentFrame++;
 	}
 
 	return true;
 }
 
-bool generateMotion(HierarchyData& hierarchyData, MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines)
+bool generateMotion(HierarchyData& hierarchyData, MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines, const LogContext& logContext)
 {
 	while (offset < bvhLines.size())
 	{
@@ -263,7 +336,7 @@ bool generateMotion(HierarchyData& hierarchyData, MotionData& motionData, size_t
 			motionData.frameTime = std::stof(line.substr(line.rfind(" ") + 1));
 
 			offset++;
-			if (!gatherSamples(motionData, offset, bvhLines))
+			if (!gatherSamples(motionData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -273,7 +346,7 @@ bool generateMotion(HierarchyData& hierarchyData, MotionData& motionData, size_t
 		}
 		else
 		{
-			printf("Error: Unknown in MOTION '%s'\n", line.c_str());
+			printf("Error: Unknown in MOTION '%s' in '%s'\n", line.c_str(), logContext.bvhFilename.c_str());
 
 			return false;
 		}
@@ -282,7 +355,7 @@ bool generateMotion(HierarchyData& hierarchyData, MotionData& motionData, size_t
 	return true;
 }
 
-bool generate(json& glTF, std::vector<uint8_t>& byteData, HierarchyData& hierarchyData, MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines)
+bool generate(json& glTF, std::vector<uint8_t>& byteData, HierarchyData& hierarchyData, MotionData& motionData, size_t& offset, const std::vector<std::string>& bvhLines, const LogContext& logContext)
 {
 	while (offset < bvhLines.size())
 	{
@@ -291,7 +364,7 @@ bool generate(json& glTF, std::vector<uint8_t>& byteData, HierarchyData& hierarc
 		if (line == "HIERARCHY")
 		{
 			offset++;
-			if (!generateHierarchy(glTF, 0, byteData, glm::mat4(1.0f), hierarchyData, offset, bvhLines))
+			if (!generateHierarchy(glTF, 0, byteData, glm::mat4(1.0f), hierarchyData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -299,7 +372,7 @@ bool generate(json& glTF, std::vector<uint8_t>& byteData, HierarchyData& hierarc
 		else if (line == "MOTION")
 		{
 			offset++;
-			if (!generateMotion(hierarchyData, motionData, offset, bvhLines))
+			if (!generateMotion(hierarchyData, motionData, offset, bvhLines, logContext))
 			{
 				return false;
 			}
@@ -307,7 +380,7 @@ bool generate(json& glTF, std::vector<uint8_t>& byteData, HierarchyData& hierarc
 		else
 		{
 			offset++;
-			printf("Error: Unknown '%s'\n", line.c_str());
+			printf("Error: Unknown '%s' in '%s'\n", line.c_str(), logContext.bvhFilename.c_str());
 		}
 	}
 
@@ -362,353 +435,1587 @@ bool saveFile(const std::string& output, const std::string& filename)
 	return true;
 }
 
-int main(int argc, char *argv[])
+//
+
+bool openBinaryFile(BinaryFile& binaryFile, const std::string& filename, size_t fileSize)
 {
-	std::string bvhFilename = "Example1.bvh";
+	BinaryFileTimer binaryFileTimer{binaryFile};
 
-	std::string saveGltfName = "untitled.gltf";
-	std::string saveBinaryName = "untitled.bin";
+#if defined(__linux__)
+	binaryFile.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (binaryFile.fd < 0)
+	{
+		return false;
+	}
 
-    for (int i = 0; i < argc; i++)
-    {
-        if (strcmp(argv[i], "-f") == 0 && (i + 1 < argc))
-        {
-        	bvhFilename = argv[i + 1];
-        }
-    }
+	if (fileSize > 0)
+	{
+		// Reserve the blocks up front. If the file system does not support it, at least set the final size.
+		if (fallocate(binaryFile.fd, 0, 0, (off_t)fileSize) != 0 && ftruncate(binaryFile.fd, (off_t)fileSize) != 0)
+		{
+			close(binaryFile.fd);
+			binaryFile.fd = -1;
 
-    //
-    // BVH loading
-    //
+			std::error_code errorCode;
+			std::filesystem::remove(filename, errorCode);
 
-    std::string bvhContent;
-	if (!loadFile(bvhContent, bvhFilename))
+			return false;
+		}
+	}
+#else
+	binaryFile.file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+	if (!binaryFile.file.is_open())
 	{
-		printf("Error: Could not load BVH file '%s'\n", bvhFilename.c_str());
-
-		return -1;
+		return false;
 	}
 
-	printf("Info: Loaded BVH '%s'\n", bvhFilename.c_str());
+	if (fileSize > 0)
+	{
+		// Extend the file to its final size by writing the last byte.
+		binaryFile.file.seekp(fileSize - 1);
+		binaryFile.file.put('\0');
+		if (!binaryFile.file.good())
+		{
+			binaryFile.file.close();
 
-	std::vector<std::string> bvhLines;
-	gatherLines(bvhLines, bvhContent);
+			std::error_code errorCode;
+			std::filesystem::remove(filename, errorCode);
 
-    //
-    // glTF setup
-    //
+			return false;
+		}
+	}
+#endif
 
-	std::vector<uint8_t> byteData;
-	std::string data;
+	binaryFile.filename = filename;
+	binaryFile.fileSize = fileSize;
 
-    json glTF = json::object();
-    glTF["asset"] = json::object();
-    glTF["asset"]["version"] = "2.0";
+	return true;
+}
 
-    glTF["scenes"] = json::array();
-    glTF["scenes"].push_back(json::object());
-    glTF["scenes"][0]["nodes"] = json::array();
+bool writeBinaryFile(BinaryFile& binaryFile, const void* data, size_t size, size_t byteOffset)
+{
+	BinaryFileTimer binaryFileTimer{binaryFile};
 
-    glTF["buffers"] = json::array();
-    glTF["buffers"].push_back(json::object());
-    glTF["buffers"][0]["uri"] = saveBinaryName;
+	if (byteOffset + size > binaryFile.fileSize)
+	{
+		return false;
+	}
 
-    glTF["bufferViews"] = json::array();
-    glTF["bufferViews"].push_back(json::object());
-    glTF["bufferViews"][0]["buffer"] = 0;
+#if defined(__linux__)
+	const char* current = (const char*)data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(binaryFile.fd, current, size, (off_t)byteOffset);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
 
-    glTF["accessors"] = json::array();
-    glTF["accessors"].push_back(json::object());
-    glTF["accessors"][0]["componentType"] = 5126;
-    glTF["accessors"][0]["type"] = "MAT4";
-    glTF["accessors"][0]["bufferView"] = 0;
+			return false;
+		}
 
-    glTF["skins"] = json::array();
-    glTF["skins"].push_back(json::object());
-    glTF["skins"][0]["joints"] = json::array();
-    glTF["skins"][0]["inverseBindMatrices"] = 0;
+		current += written;
+		size -= (size_t)written;
+		byteOffset += (size_t)written;
+	}
+#else
+	binaryFile.file.seekp(byteOffset);
+	binaryFile.file.write((const char*)data, size);
+	if (!binaryFile.file.good())
+	{
+		return false;
+	}
+#endif
 
-    glTF["nodes"] = json::array();
+	return true;
+}
 
-    glTF["animations"] = json::array();
-    glTF["animations"].push_back(json::object());
-    glTF["animations"][0]["samplers"] = json::array();
-    glTF["animations"][0]["channels"] = json::array();
+bool closeBinaryFile(BinaryFile& binaryFile)
+{
+	BinaryFileTimer binaryFileTimer{binaryFile};
 
-    //
-    // BVH to glTF
-    //
+#if defined(__linux__)
+	if (binaryFile.fd < 0)
+	{
+		return true;
+	}
 
-    HierarchyData hierarchyData;
-    MotionData motionData;
+	binaryFile.complete = close(binaryFile.fd) == 0;
+	binaryFile.fd = -1;
+#else
+	if (!binaryFile.file.is_open())
+	{
+		return true;
+	}
 
-    size_t offset = 0;
-    if (!generate(glTF, byteData, hierarchyData, motionData, offset, bvhLines))
-    {
-    	printf("Error: Could not convert BVH to glTF\n");
+	binaryFile.file.close();
 
-    	return -1;
-    }
+	binaryFile.complete = !binaryFile.file.fail();
+#endif
 
-    //
+	return binaryFile.complete;
+}
 
-	size_t currentDataIndex = 0;
+// Closes and deletes an incomplete file, so no broken output is left behind.
+void discardBinaryFile(BinaryFile& binaryFile)
+{
+	closeBinaryFile(binaryFile);
 
-    // Sorting data per node, target position and rotation
-    for (size_t currentFrameIndex = 0; currentFrameIndex < motionData.frames; currentFrameIndex++)
-    {
-    	currentDataIndex = 0;
+	std::error_code errorCode;
+	std::filesystem::remove(binaryFile.filename, errorCode);
 
-    	for (auto& currentNode : hierarchyData.nodeDatas)
-    	{
-        	for (size_t p = 0; p < currentNode.positionChannels.size(); p++)
-    		{
-        		currentNode.positionData.push_back(motionData.frameDatas[currentFrameIndex].values[currentDataIndex]);
-    			currentDataIndex++;
-    		}
-    		for (size_t r = 0; r < currentNode.rotationChannels.size(); r++)
-    		{
-    			currentNode.rotationData.push_back(motionData.frameDatas[currentFrameIndex].values[currentDataIndex]);
-    			currentDataIndex++;
-    		}
-    	}
-    }
+	binaryFile.complete = false;
+	binaryFile.filename.clear();
+}
 
-    //
+BinaryFile::~BinaryFile()
+{
+	if (!complete && !filename.empty())
+	{
+		discardBinaryFile(*this);
+	}
+}
 
-    size_t byteOffset = 0;
+//
+// Asynchronous reading
+//
 
-    data.resize(byteData.size());
-    // Copy current content
-    memcpy(data.data() + byteOffset, byteData.data(), byteData.size());
+#if defined(__linux__)
+
+// Minimal io_uring used through the raw system calls, so several reads are outstanding at once.
+struct AsyncReader {
+	int fd = -1;
+	void* sqRing = nullptr;
+	size_t sqRingSize = 0;
+	void* cqRing = nullptr;
+	size_t cqRingSize = 0;
+	io_uring_sqe* sqes = nullptr;
+	size_t sqesSize = 0;
+
+	unsigned* sqTail = nullptr;
+	unsigned* sqMask = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	unsigned* cqMask = nullptr;
+	io_uring_cqe* cqes = nullptr;
+
+	unsigned toSubmit = 0;
+};
 
-    glTF["bufferViews"][0]["byteLength"] = data.size();
-    glTF["accessors"][0]["count"] = glTF["nodes"].size();
+void closeAsyncReader(AsyncReader& asyncReader)
+{
+	if (asyncReader.sqes)
+	{
+		munmap(asyncReader.sqes, asyncReader.sqesSize);
+		asyncReader.sqes = nullptr;
+	}
+	if (asyncReader.cqRing && asyncReader.cqRing != asyncReader.sqRing)
+	{
+		munmap(asyncReader.cqRing, asyncReader.cqRingSize);
+	}
+	asyncReader.cqRing = nullptr;
+	if (asyncReader.sqRing)
+	{
+		munmap(asyncReader.sqRing, asyncReader.sqRingSize);
+		asyncReader.sqRing = nullptr;
+	}
+	if (asyncReader.fd >= 0)
+	{
+		close(asyncReader.fd);
+		asyncReader.fd = -1;
+	}
+}
 
-    byteOffset = data.size();
+// Fails, if io_uring is not available e.g. on old kernels or when blocked by a sandbox.
+bool openAsyncReader(AsyncReader& asyncReader, unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
 
-    //
-    // Key frames
-    //
+	asyncReader.fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (asyncReader.fd < 0)
+	{
+		return false;
+	}
 
-    std::vector<float> keyframes(motionData.frames);
-    for (size_t i = 0; i < motionData.frames; i++)
-    {
-    	keyframes[i] = motionData.frameTime * (float)i;
-    }
+	asyncReader.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	asyncReader.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		asyncReader.sqRingSize = std::max(asyncReader.sqRingSize, asyncReader.cqRingSize);
+		asyncReader.cqRingSize = asyncReader.sqRingSize;
+	}
 
-	size_t bufferViewIndex = glTF["bufferViews"].size();
+	void* sqRing = mmap(nullptr, asyncReader.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, asyncReader.fd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		closeAsyncReader(asyncReader);
 
-    glTF["bufferViews"].push_back(json::object());
-    glTF["bufferViews"][bufferViewIndex]["buffer"] = 0;
-    glTF["bufferViews"][bufferViewIndex]["byteOffset"] = byteOffset;
-    glTF["bufferViews"][bufferViewIndex]["byteLength"] = motionData.frames * sizeof(float);
+		return false;
+	}
+	asyncReader.sqRing = sqRing;
 
-	size_t accessorIndex = glTF["accessors"].size();
+	void* cqRing = sqRing;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cqRing = mmap(nullptr, asyncReader.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, asyncReader.fd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+		{
+			closeAsyncReader(asyncReader);
 
-    glTF["accessors"].push_back(json::object());
-    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
-    glTF["accessors"][accessorIndex]["componentType"] = 5126;
-    glTF["accessors"][accessorIndex]["count"] = motionData.frames;
-    glTF["accessors"][accessorIndex]["type"] = "SCALAR";
+			return false;
+		}
+	}
+	asyncReader.cqRing = cqRing;
 
-    glTF["accessors"][accessorIndex]["min"] = json::array();
-    glTF["accessors"][accessorIndex]["min"].push_back(keyframes.front());
+	asyncReader.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, asyncReader.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, asyncReader.fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		closeAsyncReader(asyncReader);
 
-    glTF["accessors"][accessorIndex]["max"] = json::array();
-    glTF["accessors"][accessorIndex]["max"].push_back(keyframes.back());
+		return false;
+	}
+	asyncReader.sqes = (io_uring_sqe*)sqes;
 
-    data.resize(data.size() + keyframes.size() * sizeof(float));
-    memcpy(data.data() + byteOffset, keyframes.data(), keyframes.size() * sizeof(float));
+	asyncReader.sqTail = (unsigned*)((char*)sqRing + params.sq_off.tail);
+	asyncReader.sqMask = (unsigned*)((char*)sqRing + params.sq_off.ring_mask);
+	asyncReader.sqArray = (unsigned*)((char*)sqRing + params.sq_off.array);
+	asyncReader.cqHead = (unsigned*)((char*)cqRing + params.cq_off.head);
+	asyncReader.cqTail = (unsigned*)((char*)cqRing + params.cq_off.tail);
+	asyncReader.cqMask = (unsigned*)((char*)cqRing + params.cq_off.ring_mask);
+	asyncReader.cqes = (io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
 
-    byteOffset = data.size();
+	return true;
+}
 
-    //
+// Queues a read, which is submitted by the next waitAsyncReads().
+void queueAsyncRead(AsyncReader& asyncReader, int fd, void* buffer, unsigned size, uint64_t offset, uint64_t userData)
+{
+	unsigned tail = *asyncReader.sqTail;
+	unsigned index = tail & *asyncReader.sqMask;
+
+	io_uring_sqe& sqe = asyncReader.sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = fd;
+	sqe.addr = (uint64_t)(uintptr_t)buffer;
+	sqe.len = size;
+	sqe.off = offset;
+	sqe.user_data = userData;
+
+	asyncReader.sqArray[index] = index;
+	__atomic_store_n(asyncReader.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	asyncReader.toSubmit++;
+}
 
-    size_t inputAccessorIndex = accessorIndex;
+// Submits the queued reads and waits for at least one of them. Completions are pairs of user data and result.
+bool waitAsyncReads(AsyncReader& asyncReader, std::vector<std::pair<uint64_t, int>>& completions)
+{
+	int result;
+	do
+	{
+		result = (int)syscall(__NR_io_uring_enter, asyncReader.fd, asyncReader.toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+	} while (result < 0 && errno == EINTR);
 
-	//
+	if (result < 0)
+	{
+		return false;
+	}
+	asyncReader.toSubmit -= std::min(asyncReader.toSubmit, (unsigned)result);
 
-    size_t animationSamplerIndex;
-    size_t animationChannelIndex;
+	completions.clear();
 
-    // Generate animations, as we now do have all the data sorted out.
-	for (size_t currentNodeIndex = 0; currentNodeIndex < hierarchyData.nodeDatas.size(); currentNodeIndex++)
+	unsigned head = *asyncReader.cqHead;
+	unsigned tail = __atomic_load_n(asyncReader.cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail)
 	{
-		auto& currentNode = hierarchyData.nodeDatas[currentNodeIndex];
+		const io_uring_cqe& cqe = asyncReader.cqes[head & *asyncReader.cqMask];
+		completions.emplace_back(cqe.user_data, cqe.res);
 
-		if (currentNode.positionChannels.size() > 0)
-		{
-			bufferViewIndex = glTF["bufferViews"].size();
+		head++;
+	}
+	__atomic_store_n(asyncReader.cqHead, head, __ATOMIC_RELEASE);
 
-		    glTF["bufferViews"].push_back(json::object());
-		    glTF["bufferViews"][bufferViewIndex]["buffer"] = 0;
-		    glTF["bufferViews"][bufferViewIndex]["byteOffset"] = byteOffset;
-		    glTF["bufferViews"][bufferViewIndex]["byteLength"] = motionData.frames * 3 * sizeof(float);
+	return true;
+}
 
-		    //
+#endif
 
-			accessorIndex = glTF["accessors"].size();
+//
+// Channel encoding
+//
 
-		    glTF["accessors"].push_back(json::object());
-		    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
-		    glTF["accessors"][accessorIndex]["componentType"] = 5126;
-		    glTF["accessors"][accessorIndex]["count"] = motionData.frames;
-		    glTF["accessors"][accessorIndex]["type"] = "VEC3";
+enum ChannelEncoding {
+	CHANNEL_DROPPED,
+	CHANNEL_LINEAR,
+	CHANNEL_REDUCED,
+	CHANNEL_SPARSE
+};
 
-		    //
+static const char* const channelEncodingNames[] = {"dropped", "LINEAR", "reduced", "sparse"};
+
+struct ChannelLayout {
+	ChannelEncoding encoding = CHANNEL_DROPPED;
+	size_t byteLength = 0;
+	// Size as sparse accessor, not counting the base. Zero, if not possible.
+	size_t sparseByteLength = 0;
+	// Frames written by the reduced or sparse encoding, kept from the analysis until the channel is written.
+	std::vector<size_t> reducedKeys;
+	std::vector<uint32_t> sparseIndices;
+	// Reduced keys all hold the same value, so STEP plays them back the same.
+	bool held = false;
+};
 
-		    std::vector<float> finalPositionData(motionData.frames * 3);
+size_t alignByteLength(size_t byteLength)
+{
+	return (byteLength + 3) & ~(size_t)3;
+}
 
-		    for (size_t currentFrameIndex = 0; currentFrameIndex < motionData.frames; currentFrameIndex++)
-		    {
-		    	for (size_t i = 0; i < currentNode.positionChannels.size(); i++)
-		    	{
-		    		if (currentNode.positionChannels[i] == "Xposition")
-		    		{
-		    			finalPositionData[currentFrameIndex * 3 + 0] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
-		    		}
-		    		else if (currentNode.positionChannels[i] == "Yposition")
-		    		{
-		    			finalPositionData[currentFrameIndex * 3 + 1] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
-		    		}
-		    		else if (currentNode.positionChannels[i] == "Zposition")
-		    		{
-		    			finalPositionData[currentFrameIndex * 3 + 2] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
-		    		}
-		    	}
-		    }
+bool equalElements(const float* a, const float* b, size_t components, float tolerance)
+{
+	for (size_t i = 0; i < components; i++)
+	{
+		if (fabsf(a[i] - b[i]) > tolerance)
+		{
+			return false;
+		}
+	}
 
-		    data.resize(data.size() + finalPositionData.size() * sizeof(float));
-		    memcpy(data.data() + byteOffset, finalPositionData.data(), finalPositionData.size() * sizeof(float));
+	return true;
+}
 
-		    byteOffset = data.size();
+// Frames, which start or end a run of values held within half the tolerance, plus the first and last frame.
+// Interpolating linearly between them keeps every change as a ramp from the previous frame, like the dense channel,
+// and stays within the tolerance inside a run.
+void gatherReducedKeys(std::vector<size_t>& reducedKeys, const std::vector<float>& values, size_t components, size_t frames, float tolerance)
+{
+	if (frames == 0)
+	{
+		return;
+	}
 
-		    //
+	size_t runStart = 0;
+	reducedKeys.push_back(0);
 
-		    animationSamplerIndex = glTF["animations"][0]["samplers"].size();
-		    animationChannelIndex = glTF["animations"][0]["channels"].size();
+	for (size_t currentFrameIndex = 1; currentFrameIndex < frames; currentFrameIndex++)
+	{
+		if (!equalElements(&values[currentFrameIndex * components], &values[runStart * components], components, 0.5f * tolerance))
+		{
+			if (reducedKeys.back() != currentFrameIndex - 1)
+			{
+				reducedKeys.push_back(currentFrameIndex - 1);
+			}
+			reducedKeys.push_back(currentFrameIndex);
 
-		    glTF["animations"][0]["samplers"].push_back(json::object());
-		    glTF["animations"][0]["channels"].push_back(json::object());
+			runStart = currentFrameIndex;
+		}
+	}
 
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["input"] = inputAccessorIndex;
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["interpolation"] = "LINEAR";
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["output"] = accessorIndex;
+	// The last frame is always a key, so the animation keeps its full length.
+	if (reducedKeys.back() != frames - 1)
+	{
+		reducedKeys.push_back(frames - 1);
+	}
+}
 
-		    glTF["animations"][0]["channels"][animationChannelIndex]["sampler"] = animationSamplerIndex;
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"] = json::object();
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["path"] = "translation";
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["node"] = currentNodeIndex;
-		}
-		if (currentNode.rotationChannels.size() > 0)
+// Frames, which differ from the rest value.
+void gatherSparseIndices(std::vector<uint32_t>& sparseIndices, const std::vector<float>& values, size_t components, const float* rest, size_t frames, float tolerance)
+{
+	for (size_t currentFrameIndex = 0; currentFrameIndex < frames; currentFrameIndex++)
+	{
+		if (!equalElements(&values[currentFrameIndex * components], rest, components, tolerance))
 		{
-			bufferViewIndex = glTF["bufferViews"].size();
-
-		    glTF["bufferViews"].push_back(json::object());
-		    glTF["bufferViews"][bufferViewIndex]["buffer"] = 0;
-		    glTF["bufferViews"][bufferViewIndex]["byteOffset"] = byteOffset;
-		    glTF["bufferViews"][bufferViewIndex]["byteLength"] = motionData.frames * 4 * sizeof(float);
+			sparseIndices.push_back((uint32_t)currentFrameIndex);
+		}
+	}
+}
 
-		    //
+size_t sparseIndexSize(size_t frames)
+{
+	return frames <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
 
-			accessorIndex = glTF["accessors"].size();
+// Bytes saved, if the channel is stored as sparse accessor.
+size_t sparseSavings(const ChannelLayout& channelLayout)
+{
+	if (channelLayout.encoding == CHANNEL_DROPPED || channelLayout.sparseByteLength == 0 || channelLayout.sparseByteLength >= channelLayout.byteLength)
+	{
+		return 0;
+	}
 
-		    glTF["accessors"].push_back(json::object());
-		    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
-		    glTF["accessors"][accessorIndex]["componentType"] = 5126;
-		    glTF["accessors"][accessorIndex]["count"] = motionData.frames;
-		    glTF["accessors"][accessorIndex]["type"] = "VEC4";
+	return channelLayout.byteLength - channelLayout.sparseByteLength;
+}
 
-		    //
+// Picks the smaller of all frames and the reduced keys, which both play back like the dense channel. The sparse size is only recorded,
+// as a sparse base may be shared by several channels.
+void analyzeChannel(ChannelLayout& channelLayout, const std::vector<float>& values, size_t components, const float* rest, bool sparseAllowed, size_t frames, float tolerance)
+{
+	channelLayout.reducedKeys.clear();
+	channelLayout.sparseIndices.clear();
+	channelLayout.held = false;
 
-		    std::vector<float> finalRotationData(motionData.frames * 4);
+	gatherSparseIndices(channelLayout.sparseIndices, values, components, rest, frames, tolerance);
 
-		    for (size_t currentFrameIndex = 0; currentFrameIndex < motionData.frames; currentFrameIndex++)
-		    {
-		    	glm::mat4 matrix(1.0f);
+	if (channelLayout.sparseIndices.empty())
+	{
+		// Equals the node's transform, so no animation is needed.
+		channelLayout.encoding = CHANNEL_DROPPED;
+		channelLayout.byteLength = 0;
+		channelLayout.sparseByteLength = 0;
 
-		    	for (size_t i = 0; i < currentNode.rotationChannels.size(); i++)
-		    	{
-		    		float angle = currentNode.rotationData[currentFrameIndex * currentNode.rotationChannels.size() + i];
+		return;
+	}
 
-		    		if (currentNode.rotationChannels[i] == "Xrotation")
-		    		{
-		    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(1.0f, 0.0f, 0.0f));
-		    		}
-		    		else if (currentNode.rotationChannels[i] == "Yrotation")
-		    		{
-		    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
-		    		}
-		    		else if (currentNode.rotationChannels[i] == "Zrotation")
-		    		{
-		    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(0.0f, 0.0f, 1.0f));
-		    		}
-		    	}
+	gatherReducedKeys(channelLayout.reducedKeys, values, components, frames, tolerance);
 
-		    	glm::quat rotation = glm::toQuat(matrix);
+	channelLayout.encoding = CHANNEL_LINEAR;
+	channelLayout.byteLength = frames * components * sizeof(float);
 
-		    	finalRotationData[currentFrameIndex * 4 + 0] = rotation.x;
-		    	finalRotationData[currentFrameIndex * 4 + 1] = rotation.y;
-		    	finalRotationData[currentFrameIndex * 4 + 2] = rotation.z;
-		    	finalRotationData[currentFrameIndex * 4 + 3] = rotation.w;
-		    }
+	size_t reducedByteLength = channelLayout.reducedKeys.size() * sizeof(float) + channelLayout.reducedKeys.size() * components * sizeof(float);
+	if (reducedByteLength < channelLayout.byteLength)
+	{
+		channelLayout.encoding = CHANNEL_REDUCED;
+		channelLayout.byteLength = reducedByteLength;
 
-		    data.resize(data.size() + finalRotationData.size() * sizeof(float));
-		    memcpy(data.data() + byteOffset, finalRotationData.data(), finalRotationData.size() * sizeof(float));
+		channelLayout.held = true;
+		for (size_t i = 1; i < channelLayout.reducedKeys.size() && channelLayout.held; i++)
+		{
+			channelLayout.held = equalElements(&values[channelLayout.reducedKeys[i] * components], &values[channelLayout.reducedKeys[0] * components], components, 0.5f * tolerance);
+		}
+	}
+	else
+	{
+		std::vector<size_t>().swap(channelLayout.reducedKeys);
+	}
+
+	channelLayout.sparseByteLength = 0;
+	if (sparseAllowed)
+	{
+		channelLayout.sparseByteLength = alignByteLength(channelLayout.sparseIndices.size() * sparseIndexSize(frames)) + channelLayout.sparseIndices.size() * components * sizeof(float);
+	}
+
+	// Only a sparse accessor, which is smaller than the chosen encoding, may still be picked.
+	if (sparseSavings(channelLayout) == 0)
+	{
+		std::vector<uint32_t>().swap(channelLayout.sparseIndices);
+	}
+}
+
+void applySparse(ChannelLayout& channelLayout)
+{
+	if (sparseSavings(channelLayout) > 0)
+	{
+		channelLayout.encoding = CHANNEL_SPARSE;
+		channelLayout.byteLength = channelLayout.sparseByteLength;
+
+		std::vector<size_t>().swap(channelLayout.reducedKeys);
+	}
+	else
+	{
+		std::vector<uint32_t>().swap(channelLayout.sparseIndices);
+	}
+}
+
+//
+
+glm::vec3 getRestTranslation(const json& glTF, size_t nodeIndex)
+{
+	if (!glTF["nodes"][nodeIndex].contains("translation"))
+	{
+		return glm::vec3(0.0f, 0.0f, 0.0f);
+	}
+
+	const json& translation = glTF["nodes"][nodeIndex]["translation"];
+
+	return glm::vec3(translation[0].get<float>(), translation[1].get<float>(), translation[2].get<float>());
+}
+
+void convertPositionData(std::vector<float>& finalPositionData, const NodeData& currentNode, size_t frames)
+{
+    finalPositionData.assign(frames * 3, 0.0f);
+
+    for (size_t currentFrameIndex = 0; currentFrameIndex < frames; currentFrameIndex++)
+    {
+    	for (size_t i = 0; i < currentNode.positionChannels.size(); i++)
+    	{
+    		if (currentNode.positionChannels[i] == "Xposition")
+    		{
+    			finalPositionData[currentFrameIndex * 3 + 0] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
+    		}
+    		else if (currentNode.positionChannels[i] == "Yposition")
+    		{
+    			finalPositionData[currentFrameIndex * 3 + 1] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
+    		}
+    		else if (currentNode.positionChannels[i] == "Zposition")
+    		{
+    			finalPositionData[currentFrameIndex * 3 + 2] = currentNode.positionData[currentFrameIndex * currentNode.positionChannels.size() + i];
+    		}
+    	}
+    }
+}
+
+void convertRotationData(std::vector<float>& finalRotationData, const NodeData& currentNode, size_t frames)
+{
+    finalRotationData.assign(frames * 4, 0.0f);
+
+    for (size_t currentFrameIndex = 0; currentFrameIndex < frames; currentFrameIndex++)
+    {
+    	glm::mat4 matrix(1.0f);
+
+    	for (size_t i = 0; i < currentNode.rotationChannels.size(); i++)
+    	{
+    		float angle = currentNode.rotationData[currentFrameIndex * currentNode.rotationChannels.size() + i];
+
+    		if (currentNode.rotationChannels[i] == "Xrotation")
+    		{
+    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(1.0f, 0.0f, 0.0f));
+    		}
+    		else if (currentNode.rotationChannels[i] == "Yrotation")
+    		{
+    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
+    		}
+    		else if (currentNode.rotationChannels[i] == "Zrotation")
+    		{
+    			matrix = matrix * glm::rotate(glm::radians(angle), glm::vec3(0.0f, 0.0f, 1.0f));
+    		}
+    	}
+
+    	glm::quat rotation = glm::toQuat(matrix);
+
+    	finalRotationData[currentFrameIndex * 4 + 0] = rotation.x;
+    	finalRotationData[currentFrameIndex * 4 + 1] = rotation.y;
+    	finalRotationData[currentFrameIndex * 4 + 2] = rotation.z;
+    	finalRotationData[currentFrameIndex * 4 + 3] = rotation.w;
+    }
+}
+
+//
+
+// Writes the data at the current offset and adds a buffer view for it.
+bool writeBufferView(json& glTF, size_t& bufferViewIndex, BinaryFile& binaryFile, const void* data, size_t size, size_t& byteOffset)
+{
+	if (!writeBinaryFile(binaryFile, data, size, byteOffset))
+	{
+		return false;
+	}
+
+	bufferViewIndex = glTF["bufferViews"].size();
+
+    glTF["bufferViews"].push_back(json::object());
+    glTF["bufferViews"][bufferViewIndex]["buffer"] = 0;
+    glTF["bufferViews"][bufferViewIndex]["byteOffset"] = byteOffset;
+    glTF["bufferViews"][bufferViewIndex]["byteLength"] = size;
+
+    byteOffset += alignByteLength(size);
+
+    return true;
+}
+
+void addAnimationChannel(json& glTF, size_t inputAccessorIndex, size_t outputAccessorIndex, const std::string& interpolation, const std::string& path, size_t nodeIndex)
+{
+    size_t animationSamplerIndex = glTF["animations"][0]["samplers"].size();
+    size_t animationChannelIndex = glTF["animations"][0]["channels"].size();
+
+    glTF["animations"][0]["samplers"].push_back(json::object());
+    glTF["animations"][0]["channels"].push_back(json::object());
+
+    glTF["animations"][0]["samplers"][animationSamplerIndex]["input"] = inputAccessorIndex;
+    glTF["animations"][0]["samplers"][animationSamplerIndex]["interpolation"] = interpolation;
+    glTF["animations"][0]["samplers"][animationSamplerIndex]["output"] = outputAccessorIndex;
+
+    glTF["animations"][0]["channels"][animationChannelIndex]["sampler"] = animationSamplerIndex;
+    glTF["animations"][0]["channels"][animationChannelIndex]["target"] = json::object();
+    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["path"] = path;
+    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["node"] = nodeIndex;
+}
+
+// Writes one converted channel in the encoding chosen by analyzeChannel().
+bool writeChannel(json& glTF, BinaryFile& binaryFile, size_t& byteOffset, const ChannelLayout& channelLayout, const std::vector<float>& values, size_t components, const std::vector<float>& keyframes, size_t inputAccessorIndex, const json& sparseBaseBufferView, size_t frames, const std::string& path, size_t nodeIndex, const LogContext& logContext)
+{
+	const char* type = components == 3 ? "VEC3" : "VEC4";
+
+	size_t bufferViewIndex;
+	size_t accessorIndex;
+
+	if (channelLayout.encoding == CHANNEL_LINEAR)
+	{
+		if (!writeBufferView(glTF, bufferViewIndex, binaryFile, values.data(), frames * components * sizeof(float), byteOffset))
+		{
+			return false;
+		}
+
+		accessorIndex = glTF["accessors"].size();
+
+	    glTF["accessors"].push_back(json::object());
+	    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
+	    glTF["accessors"][accessorIndex]["componentType"] = 5126;
+	    glTF["accessors"][accessorIndex]["count"] = frames;
+	    glTF["accessors"][accessorIndex]["type"] = type;
+
+	    addAnimationChannel(glTF, inputAccessorIndex, accessorIndex, "LINEAR", path, nodeIndex);
+	}
+	else if (channelLayout.encoding == CHANNEL_REDUCED)
+	{
+		const std::vector<size_t>& reducedKeys = channelLayout.reducedKeys;
+
+		std::vector<float> reducedKeyframes(reducedKeys.size());
+		std::vector<float> reducedValues(reducedKeys.size() * components);
+		for (size_t i = 0; i < reducedKeys.size(); i++)
+		{
+			reducedKeyframes[i] = keyframes[reducedKeys[i]];
+			memcpy(&reducedValues[i * components], &values[reducedKeys[i] * components], components * sizeof(float));
+		}
+
+		if (!writeBufferView(glTF, bufferViewIndex, binaryFile, reducedKeyframes.data(), reducedKeyframes.size() * sizeof(float), byteOffset))
+		{
+			return false;
+		}
+
+		size_t reducedInputAccessorIndex = glTF["accessors"].size();
+
+	    glTF["accessors"].push_back(json::object());
+	    glTF["accessors"][reducedInputAccessorIndex]["bufferView"] = bufferViewIndex;
+	    glTF["accessors"][reducedInputAccessorIndex]["componentType"] = 5126;
+	    glTF["accessors"][reducedInputAccessorIndex]["count"] = reducedKeyframes.size();
+	    glTF["accessors"][reducedInputAccessorIndex]["type"] = "SCALAR";
 
-		    byteOffset = data.size();
+	    glTF["accessors"][reducedInputAccessorIndex]["min"] = json::array();
+	    glTF["accessors"][reducedInputAccessorIndex]["min"].push_back(reducedKeyframes.front());
 
-		    //
+	    glTF["accessors"][reducedInputAccessorIndex]["max"] = json::array();
+	    glTF["accessors"][reducedInputAccessorIndex]["max"].push_back(reducedKeyframes.back());
 
-		    animationChannelIndex = glTF["animations"][0]["channels"].size();
-		    animationSamplerIndex = glTF["animations"][0]["samplers"].size();
+		if (!writeBufferView(glTF, bufferViewIndex, binaryFile, reducedValues.data(), reducedValues.size() * sizeof(float), byteOffset))
+		{
+			return false;
+		}
+
+		accessorIndex = glTF["accessors"].size();
 
-		    glTF["animations"][0]["samplers"].push_back(json::object());
-		    glTF["animations"][0]["channels"].push_back(json::object());
+	    glTF["accessors"].push_back(json::object());
+	    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
+	    glTF["accessors"][accessorIndex]["componentType"] = 5126;
+	    glTF["accessors"][accessorIndex]["count"] = reducedKeys.size();
+	    glTF["accessors"][accessorIndex]["type"] = type;
 
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["input"] = inputAccessorIndex;
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["interpolation"] = "LINEAR";
-		    glTF["animations"][0]["samplers"][animationSamplerIndex]["output"] = accessorIndex;
+	    addAnimationChannel(glTF, reducedInputAccessorIndex, accessorIndex, channelLayout.held ? "STEP" : "LINEAR", path, nodeIndex);
+	}
+	else if (channelLayout.encoding == CHANNEL_SPARSE)
+	{
+		const std::vector<uint32_t>& sparseIndices = channelLayout.sparseIndices;
+
+		std::vector<float> sparseValues(sparseIndices.size() * components);
+		for (size_t i = 0; i < sparseIndices.size(); i++)
+		{
+			memcpy(&sparseValues[i * components], &values[sparseIndices[i] * components], components * sizeof(float));
+		}
 
-		    glTF["animations"][0]["channels"][animationChannelIndex]["sampler"] = animationSamplerIndex;
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"] = json::object();
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["path"] = "rotation";
-		    glTF["animations"][0]["channels"][animationChannelIndex]["target"]["node"] = currentNodeIndex;
+		size_t indicesBufferViewIndex;
+		bool success;
+		if (sparseIndexSize(frames) == sizeof(uint16_t))
+		{
+			std::vector<uint16_t> shortIndices(sparseIndices.begin(), sparseIndices.end());
+			success = writeBufferView(glTF, indicesBufferViewIndex, binaryFile, shortIndices.data(), shortIndices.size() * sizeof(uint16_t), byteOffset);
+		}
+		else
+		{
+			success = writeBufferView(glTF, indicesBufferViewIndex, binaryFile, sparseIndices.data(), sparseIndices.size() * sizeof(uint32_t), byteOffset);
+		}
+		if (!success || !writeBufferView(glTF, bufferViewIndex, binaryFile, sparseValues.data(), sparseValues.size() * sizeof(float), byteOffset))
+		{
+			return false;
 		}
+
+		accessorIndex = glTF["accessors"].size();
+
+	    glTF["accessors"].push_back(json::object());
+	    // Without a buffer view, the base is all zeros.
+	    if (!sparseBaseBufferView.is_null())
+	    {
+	    	glTF["accessors"][accessorIndex]["bufferView"] = sparseBaseBufferView;
+	    }
+	    glTF["accessors"][accessorIndex]["componentType"] = 5126;
+	    glTF["accessors"][accessorIndex]["count"] = frames;
+	    glTF["accessors"][accessorIndex]["type"] = type;
+
+	    glTF["accessors"][accessorIndex]["sparse"] = json::object();
+	    glTF["accessors"][accessorIndex]["sparse"]["count"] = sparseIndices.size();
+	    glTF["accessors"][accessorIndex]["sparse"]["indices"] = json::object();
+	    glTF["accessors"][accessorIndex]["sparse"]["indices"]["bufferView"] = indicesBufferViewIndex;
+	    glTF["accessors"][accessorIndex]["sparse"]["indices"]["componentType"] = sparseIndexSize(frames) == sizeof(uint16_t) ? 5123 : 5125;
+	    glTF["accessors"][accessorIndex]["sparse"]["values"] = json::object();
+	    glTF["accessors"][accessorIndex]["sparse"]["values"]["bufferView"] = bufferViewIndex;
+
+	    addAnimationChannel(glTF, inputAccessorIndex, accessorIndex, "LINEAR", path, nodeIndex);
+	}
+
+	if (logContext.verbose)
+	{
+		printf("Info: %s: Node '%s' %s channel is %s with %zu bytes\n", logContext.bvhFilename.c_str(), glTF["nodes"][nodeIndex]["name"].get<std::string>().c_str(), path.c_str(), channelEncodingNames[channelLayout.encoding], channelLayout.byteLength);
 	}
 
+	return true;
+}
+
+bool convert(json& glTF, const std::vector<std::string>& bvhLines, const std::string& saveBinaryName, const std::string& binaryUri, float tolerance, int64_t& binaryMicroseconds, const LogContext& logContext)
+{
+    //
+    // glTF setup
+    //
+
+	std::vector<uint8_t> byteData;
+
+    glTF = json::object();
+    glTF["asset"] = json::object();
+    glTF["asset"]["version"] = "2.0";
+
+    glTF["scenes"] = json::array();
+    glTF["scenes"].push_back(json::object());
+    glTF["scenes"][0]["nodes"] = json::array();
+
+    glTF["buffers"] = json::array();
+    glTF["buffers"].push_back(json::object());
+    glTF["buffers"][0]["uri"] = binaryUri;
+
+    glTF["bufferViews"] = json::array();
+    glTF["bufferViews"].push_back(json::object());
+    glTF["bufferViews"][0]["buffer"] = 0;
+
+    glTF["accessors"] = json::array();
+    glTF["accessors"].push_back(json::object());
+    glTF["accessors"][0]["componentType"] = 5126;
+    glTF["accessors"][0]["type"] = "MAT4";
+    glTF["accessors"][0]["bufferView"] = 0;
+
+    glTF["skins"] = json::array();
+    glTF["skins"].push_back(json::object());
+    glTF["skins"][0]["joints"] = json::array();
+    glTF["skins"][0]["inverseBindMatrices"] = 0;
+
+    glTF["nodes"] = json::array();
+
+    glTF["animations"] = json::array();
+    glTF["animations"].push_back(json::object());
+    glTF["animations"][0]["samplers"] = json::array();
+    glTF["animations"][0]["channels"] = json::array();
+
+    //
+    // BVH to glTF
     //
 
-    size_t nodeIndex = glTF["nodes"].size();
+    HierarchyData hierarchyData;
+    MotionData motionData;
 
-    glTF["scenes"][0]["nodes"].push_back(nodeIndex);
+    size_t offset = 0;
+    if (!generate(glTF, byteData, hierarchyData, motionData, offset, bvhLines, logContext))
+    {
+    	printf("Error: Could not parse BVH '%s'\n", logContext.bvhFilename.c_str());
 
-    glTF["nodes"].push_back(json::object());
-    glTF["nodes"][nodeIndex]["name"] = "Mesh";
-    glTF["nodes"][nodeIndex]["skin"] = 0;
+    	return false;
+    }
+
+    if (motionData.frames == 0)
+    {
+    	printf("Error: BVH '%s' has no frames\n", logContext.bvhFilename.c_str());
 
-    glTF["buffers"][0]["byteLength"] = data.size();
+    	return false;
+    }
 
     //
-	// Saving everything
-	//
 
-	if (!saveFile(data, saveBinaryName))
+	size_t currentDataIndex = 0;
+
+    // Sorting data per node, target position and rotation
+    for (size_t currentFrameIndex = 0; currentFrameIndex < motionData.frames; currentFrameIndex++)
+    {
+    	currentDataIndex = 0;
+
+    	for (auto& currentNode : hierarchyData.nodeDatas)
+    	{
+        	for (size_t p = 0; p < currentNode.positionChannels.size(); p++)
+    		{
+        		currentNode.positionData.push_back(motionData.frameDatas[currentFrameIndex].values[currentDataIndex]);
+    			currentDataIndex++;
+    		}
+    		for (size_t r = 0; r < currentNode.rotationChannels.size(); r++)
+    		{
+    			currentNode.rotationData.push_back(motionData.frameDatas[currentFrameIndex].values[currentDataIndex]);
+    			currentDataIndex++;
+    		}
+    	}
+    }
+
+    //
+    // Binary layout
+    //
+
+    const float identityRotation[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+    std::vector<ChannelLayout> positionLayouts(hierarchyData.nodeDatas.size());
+    std::vector<ChannelLayout> rotationLayouts(hierarchyData.nodeDatas.size());
+
+    // Each channel is converted once and replaces its BVH data, so the write pass below reuses it.
+    std::vector<float> finalData;
+	for (size_t currentNodeIndex = 0; currentNodeIndex < hierarchyData.nodeDatas.size(); currentNodeIndex++)
 	{
-		printf("Error: Could not save generated bin file '%s'\n", saveBinaryName.c_str());
+		auto& currentNode = hierarchyData.nodeDatas[currentNodeIndex];
+
+		if (currentNode.positionChannels.size() > 0)
+		{
+			glm::vec3 restTranslation = getRestTranslation(glTF, currentNodeIndex);
+			// Sparse translations are only possible on the implicit zero base.
+			bool sparseAllowed = restTranslation.x == 0.0f && restTranslation.y == 0.0f && restTranslation.z == 0.0f;
+
+			convertPositionData(finalData, currentNode, motionData.frames);
+			analyzeChannel(positionLayouts[currentNodeIndex], finalData, 3, &restTranslation.x, sparseAllowed, motionData.frames, tolerance);
+			applySparse(positionLayouts[currentNodeIndex]);
+
+			currentNode.positionData.swap(finalData);
+		}
+		if (currentNode.rotationChannels.size() > 0)
+		{
+			convertRotationData(finalData, currentNode, motionData.frames);
+			analyzeChannel(rotationLayouts[currentNodeIndex], finalData, 4, identityRotation, true, motionData.frames, tolerance);
+
+			currentNode.rotationData.swap(finalData);
+		}
+	}
+
+	// Sparse rotations share one buffer view of identity rotations as their base, which has to pay off in total.
+	size_t identitySavings = 0;
+	for (const auto& rotationLayout : rotationLayouts)
+	{
+		identitySavings += sparseSavings(rotationLayout);
+	}
+
+	bool identityBase = identitySavings > motionData.frames * 4 * sizeof(float);
+	for (auto& rotationLayout : rotationLayouts)
+	{
+		if (identityBase)
+		{
+			applySparse(rotationLayout);
+		}
+		else
+		{
+			std::vector<uint32_t>().swap(rotationLayout.sparseIndices);
+		}
+	}
 
-		return -1;
+    // The final size is known before any animation data is written, so the binary file is preallocated
+    // and every block is written at its offset as soon as it is ready.
+    size_t binarySize = byteData.size() + motionData.frames * sizeof(float);
+    if (identityBase)
+    {
+    	binarySize += motionData.frames * 4 * sizeof(float);
+    }
+	for (size_t currentNodeIndex = 0; currentNodeIndex < hierarchyData.nodeDatas.size(); currentNodeIndex++)
+	{
+		binarySize += positionLayouts[currentNodeIndex].byteLength + rotationLayouts[currentNodeIndex].byteLength;
 	}
 
-	if (!saveFile(glTF.dump(3), saveGltfName))
+    BinaryFile binaryFile;
+    binaryFile.writeMicroseconds = &binaryMicroseconds;
+	if (!openBinaryFile(binaryFile, saveBinaryName, binarySize))
 	{
-		printf("Error: Could not save generated glTF file '%s'\n", saveGltfName.c_str());
+		printf("Error: Could not create bin file '%s'\n", saveBinaryName.c_str());
+
+		return false;
+	}
+
+    size_t byteOffset = 0;
 
-		return -1;
+    // Copy current content
+	if (!writeBinaryFile(binaryFile, byteData.data(), byteData.size(), byteOffset))
+	{
+		printf("Error: Could not write bin file '%s'\n", saveBinaryName.c_str());
+		return false;
 	}
 
-	printf("Info: Saved glTF '%s'\n", saveGltfName.c_str());
+    glTF["bufferViews"][0]["byteLength"] = byteData.size();
+    glTF["accessors"][0]["count"] = glTF["nodes"].size();
+
+    byteOffset += byteData.size();
+
+    //
+    // Key frames
+    //
+
+    std::vector<float> keyframes(motionData.frames);
+    for (size_t i = 0; i < motionData.frames; i++)
+    {
+    	keyframes[i] = motionData.frameTime * (float)i;
+    }
+
+	size_t bufferViewIndex = glTF["bufferViews"].size();
+
+    glTF["bufferViews"].push_back(json::object());
+    glTF["bufferViews"][bufferViewIndex]["buffer"] = 0;
+    glTF["bufferViews"][bufferViewIndex]["byteOffset"] = byteOffset;
+    glTF["bufferViews"][bufferViewIndex]["byteLength"] = motionData.frames * sizeof(float);
+
+	size_t accessorIndex = glTF["accessors"].size();
+
+    glTF["accessors"].push_back(json::object());
+    glTF["accessors"][accessorIndex]["bufferView"] = bufferViewIndex;
+    glTF["accessors"][accessorIndex]["componentType"] = 5126;
+    glTF["accessors"][accessorIndex]["count"] = motionData.frames;
+    glTF["accessors"][accessorIndex]["type"] = "SCALAR";
+
+    glTF["accessors"][accessorIndex]["min"] = json::array();
+    glTF["accessors"][accessorIndex]["min"].push_back(keyframes.front());
+
+    glTF["accessors"][accessorIndex]["max"] = json::array();
+    glTF["accessors"][accessorIndex]["max"].push_back(keyframes.back());
+
+	if (!writeBinaryFile(binaryFile, keyframes.data(), keyframes.size() * sizeof(float), byteOffset))
+	{
+		printf("Error: Could not write bin file '%s'\n", saveBinaryName.c_str());
+		return false;
+	}
+
+    byteOffset += keyframes.size() * sizeof(float);
+
+    //
+
+    size_t inputAccessorIndex = accessorIndex;
+
+    json identityBufferView;
+    if (identityBase)
+    {
+    	std::vector<float> identityData(motionData.frames * 4);
+    	for (size_t i = 0; i < motionData.frames; i++)
+    	{
+    		memcpy(&identityData[i * 4], identityRotation, 4 * sizeof(float));
+    	}
+
+    	if (!writeBufferView(glTF, bufferViewIndex, binaryFile, identityData.data(), identityData.size() * sizeof(float), byteOffset))
+    	{
+    		printf("Error: Could not write bin file '%s'\n", saveBinaryName.c_str());
+    		return false;
+    	}
+
+    	identityBufferView = bufferViewIndex;
+    }
+
+	//
+
+    // Generate animations, as we now do have all the data sorted out.
+	for (size_t currentNodeIndex = 0; currentNodeIndex < hierarchyData.nodeDatas.size(); currentNodeIndex++)
+	{
+		auto& currentNode = hierarchyData.nodeDatas[currentNodeIndex];
+
+		if (currentNode.positionChannels.size() > 0)
+		{
+			if (!writeChannel(glTF, binaryFile, byteOffset, positionLayouts[currentNodeIndex], currentNode.positionData, 3, keyframes, inputAccessorIndex, json(), motionData.frames, "translation", currentNodeIndex, logContext))
+			{
+		    	printf("Error: Could not write bin file '%s'\n", saveBinaryName.c_str());
+		    	return false;
+			}
+		}
+		if (currentNode.rotationChannels.size() > 0)
+		{
+			if (!writeChannel(glTF, binaryFile, byteOffset, rotationLayouts[currentNodeIndex], currentNode.rotationData, 4, keyframes, inputAccessorIndex, identityBufferView, motionData.frames, "rotation", currentNodeIndex, logContext))
+			{
+		    	printf("Error: Could not write bin file '%s'\n", saveBinaryName.c_str());
+		    	return false;
+			}
+		}
+	}
+
+	// An animation without channels is not valid.
+	if (glTF["animations"][0]["channels"].empty())
+	{
+		glTF.erase("animations");
+	}
+
+    //
+
+    size_t nodeIndex = glTF["nodes"].size();
+
+    glTF["scenes"][0]["nodes"].push_back(nodeIndex);
+
+    glTF["nodes"].push_back(json::object());
+    glTF["nodes"][nodeIndex]["name"] = "Mesh";
+    glTF["nodes"][nodeIndex]["skin"] = 0;
+
+    glTF["buffers"][0]["byteLength"] = binarySize;
+
+	// The layout and the written data are computed separately, so they have to match to the byte.
+	if (byteOffset != binarySize)
+	{
+		printf("Error: Wrote %zu bytes, but bin file '%s' has %zu bytes\n", byteOffset, saveBinaryName.c_str(), binarySize);
+
+		discardBinaryFile(binaryFile);
+
+		return false;
+	}
+
+	if (!closeBinaryFile(binaryFile))
+	{
+		printf("Error: Could not save generated bin file '%s'\n", saveBinaryName.c_str());
+
+		return false;
+	}
+
+	printf("Info: Saved bin '%s'\n", saveBinaryName.c_str());
+
+	return true;
+}
+
+//
+// Pipelined conversion of several BVH files
+//
+
+// Blocking queue with a fixed capacity, connecting two stages.
+template<typename T>
+struct BoundedQueue {
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<T> items;
+	size_t capacity = 1;
+	bool closed = false;
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]() { return items.size() < capacity; });
+
+		items.push_back(std::move(item));
+
+		notEmpty.notify_one();
+	}
+
+	// Returns false, if no item is available right now.
+	bool tryPop(T& item)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(items.front());
+		items.pop_front();
+
+		notFull.notify_one();
+
+		return true;
+	}
+
+	// Returns false, if the queue is closed and no items are left.
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+
+		if (items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(items.front());
+		items.pop_front();
+
+		notFull.notify_one();
+
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+
+		notEmpty.notify_all();
+	}
+};
+
+struct ConversionJob {
+	std::string bvhFilename;
+	std::string saveGltfName;
+	std::string saveBinaryName;
+	std::string binaryUri;
+	std::string bvhContent;
+	json glTF;
+	bool loaded = false;
+	bool converted = false;
+};
+
+struct StageStatistics {
+	const char* name = "";
+	size_t threads = 1;
+	std::atomic<int64_t> busyMicroseconds{0};
+};
+
+struct StageTimer {
+	StageStatistics& stageStatistics;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	~StageTimer()
+	{
+		stageStatistics.busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+void printStageStatistics(const StageStatistics& stageStatistics, int64_t wallMicroseconds)
+{
+	double busy = (double)stageStatistics.busyMicroseconds.load() / 1000.0;
+	double available = (double)wallMicroseconds * (double)stageStatistics.threads / 1000.0;
+	double utilization = available > 0.0 ? 100.0 * busy / available : 0.0;
+
+	printf("Info: Stage '%s' busy %.1f ms of %.1f ms on %zu thread(s) (%.1f%%)\n", stageStatistics.name, busy, available, stageStatistics.threads, utilization);
+}
+
+void finishRead(ConversionJob& job, bool loaded, BoundedQueue<ConversionJob*>& convertQueue)
+{
+	job.loaded = loaded;
+	if (job.loaded)
+	{
+		printf("Info: Loaded BVH '%s'\n", job.bvhFilename.c_str());
+	}
+	else
+	{
+		std::string().swap(job.bvhContent);
+
+		printf("Error: Could not load BVH file '%s'\n", job.bvhFilename.c_str());
+	}
+
+	convertQueue.push(&job);
+}
+
+// Reads one file after the other. Used, if asynchronous reading is not available.
+void readJobs(std::vector<ConversionJob>& jobs, size_t firstJobIndex, BoundedQueue<int>& slots, BoundedQueue<ConversionJob*>& convertQueue, StageStatistics& readStatistics)
+{
+	for (size_t jobIndex = firstJobIndex; jobIndex < jobs.size(); jobIndex++)
+	{
+		ConversionJob& job = jobs[jobIndex];
+
+		int slot;
+		slots.pop(slot);
+
+		bool loaded;
+		{
+			StageTimer stageTimer{readStatistics};
+
+			loaded = loadFile(job.bvhContent, job.bvhFilename);
+		}
+
+		finishRead(job, loaded, convertQueue);
+	}
+}
+
+#if defined(__linux__)
+
+// Keeps a read outstanding for every file, which may be in flight.
+void readJobsAsync(AsyncReader& asyncReader, std::vector<ConversionJob>& jobs, BoundedQueue<int>& slots, BoundedQueue<ConversionJob*>& convertQueue, StageStatistics& readStatistics)
+{
+	// Single reads are limited, so large files are read in several chunks.
+	const size_t maxReadSize = 1 << 30;
+
+	std::vector<int> fds(jobs.size(), -1);
+	std::vector<size_t> bytesRead(jobs.size(), 0);
+
+	std::vector<std::pair<uint64_t, int>> completions;
+
+	size_t nextJobIndex = 0;
+	size_t pendingReads = 0;
+
+	while (nextJobIndex < jobs.size() || pendingReads > 0)
+	{
+		while (nextJobIndex < jobs.size())
+		{
+			// Only block for a free slot, if there is nothing else to wait for.
+			int slot;
+			if (pendingReads == 0)
+			{
+				slots.pop(slot);
+			}
+			else if (!slots.tryPop(slot))
+			{
+				break;
+			}
+
+			size_t jobIndex = nextJobIndex;
+			nextJobIndex++;
+
+			ConversionJob& job = jobs[jobIndex];
+
+			StageTimer stageTimer{readStatistics};
+
+			struct stat fileStat;
+			fds[jobIndex] = open(job.bvhFilename.c_str(), O_RDONLY);
+			if (fds[jobIndex] < 0 || fstat(fds[jobIndex], &fileStat) != 0)
+			{
+				if (fds[jobIndex] >= 0)
+				{
+					close(fds[jobIndex]);
+				}
+
+				finishRead(job, false, convertQueue);
+
+				continue;
+			}
+
+			job.bvhContent.resize((size_t)fileStat.st_size);
+			if (job.bvhContent.empty())
+			{
+				close(fds[jobIndex]);
+
+				finishRead(job, true, convertQueue);
+
+				continue;
+			}
+
+			queueAsyncRead(asyncReader, fds[jobIndex], job.bvhContent.data(), (unsigned)std::min(job.bvhContent.size(), maxReadSize), 0, jobIndex);
+			pendingReads++;
+		}
+
+		if (pendingReads == 0)
+		{
+			continue;
+		}
+
+		bool waited;
+		{
+			StageTimer stageTimer{readStatistics};
+
+			waited = waitAsyncReads(asyncReader, completions);
+		}
+
+		if (!waited)
+		{
+			// The ring is unusable, so the outstanding and the remaining files are read directly.
+			for (size_t jobIndex = 0; jobIndex < nextJobIndex; jobIndex++)
+			{
+				if (fds[jobIndex] >= 0)
+				{
+					close(fds[jobIndex]);
+					fds[jobIndex] = -1;
+
+					finishRead(jobs[jobIndex], loadFile(jobs[jobIndex].bvhContent, jobs[jobIndex].bvhFilename), convertQueue);
+				}
+			}
+
+			readJobs(jobs, nextJobIndex, slots, convertQueue, readStatistics);
+
+			return;
+		}
+
+		for (const auto& completion : completions)
+		{
+			size_t jobIndex = (size_t)completion.first;
+			int result = completion.second;
+
+			ConversionJob& job = jobs[jobIndex];
+
+			if (result > 0)
+			{
+				bytesRead[jobIndex] += (size_t)result;
+				if (bytesRead[jobIndex] < job.bvhContent.size())
+				{
+					size_t remaining = job.bvhContent.size() - bytesRead[jobIndex];
+					queueAsyncRead(asyncReader, fds[jobIndex], job.bvhContent.data() + bytesRead[jobIndex], (unsigned)std::min(remaining, maxReadSize), bytesRead[jobIndex], jobIndex);
+
+					continue;
+				}
+			}
+
+			close(fds[jobIndex]);
+			fds[jobIndex] = -1;
+			pendingReads--;
+
+			if (result > 0)
+			{
+				finishRead(job, true, convertQueue);
+			}
+			else
+			{
+				// Errors and a shrunken file, but also old kernels without IORING_OP_READ end up here.
+				finishRead(job, loadFile(job.bvhContent, job.bvhFilename), convertQueue);
+			}
+		}
+	}
+}
+
+#endif
+
+// Reads, converts and writes the given jobs in overlapping stages. At most maxInFlight files are held in memory at once.
+size_t convertAll(std::vector<ConversionJob>& jobs, size_t workerCount, size_t maxInFlight, float tolerance, bool verbose)
+{
+	// Each token allows one more file to be in flight. The reader takes one, the writer gives it back.
+	BoundedQueue<int> slots;
+	slots.capacity = maxInFlight;
+	for (size_t i = 0; i < maxInFlight; i++)
+	{
+		slots.push(0);
+	}
+
+	BoundedQueue<ConversionJob*> convertQueue;
+	convertQueue.capacity = maxInFlight;
+
+	BoundedQueue<ConversionJob*> writeQueue;
+	writeQueue.capacity = maxInFlight;
+
+	StageStatistics readStatistics;
+	readStatistics.name = "read";
+
+	StageStatistics convertStatistics;
+	convertStatistics.name = "parse/convert";
+	convertStatistics.threads = workerCount;
+
+	// The bin file is streamed to disk by the workers during conversion, so its time is taken out of the conversion.
+	StageStatistics writeBinaryStatistics;
+	writeBinaryStatistics.name = "write bin";
+	writeBinaryStatistics.threads = workerCount;
+
+	StageStatistics writeStatistics;
+	writeStatistics.name = "write glTF";
+
+	size_t failures = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread reader([&]() {
+#if defined(__linux__)
+		AsyncReader asyncReader;
+		if (openAsyncReader(asyncReader, (unsigned)maxInFlight))
+		{
+			readJobsAsync(asyncReader, jobs, slots, convertQueue, readStatistics);
+
+			closeAsyncReader(asyncReader);
+		}
+		else
+#endif
+		{
+			readJobs(jobs, 0, slots, convertQueue, readStatistics);
+		}
+
+		convertQueue.close();
+	});
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < workerCount; i++)
+	{
+		workers.emplace_back([&]() {
+			ConversionJob* job;
+			while (convertQueue.pop(job))
+			{
+				if (job->loaded)
+				{
+					auto convertStart = std::chrono::steady_clock::now();
+
+					LogContext logContext;
+					logContext.bvhFilename = job->bvhFilename;
+					logContext.verbose = verbose;
+					int64_t binaryMicroseconds = 0;
+
+					std::vector<std::string> bvhLines;
+					gatherLines(bvhLines, job->bvhContent);
+
+					// The raw content is not needed anymore.
+					std::string().swap(job->bvhContent);
+
+					// Parsing throws on malformed numbers. This must only fail the current file.
+					try
+					{
+						job->converted = convert(job->glTF, bvhLines, job->saveBinaryName, job->binaryUri, tolerance, binaryMicroseconds, logContext);
+					}
+					catch (const std::exception& exception)
+					{
+						printf("Error: Exception '%s' while converting BVH '%s'\n", exception.what(), job->bvhFilename.c_str());
+
+						job->converted = false;
+					}
+
+					if (!job->converted)
+					{
+						printf("Error: Could not convert BVH '%s' to glTF\n", job->bvhFilename.c_str());
+					}
+
+					int64_t convertMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - convertStart).count();
+
+					convertStatistics.busyMicroseconds += convertMicroseconds - binaryMicroseconds;
+					writeBinaryStatistics.busyMicroseconds += binaryMicroseconds;
+				}
+
+				writeQueue.push(job);
+			}
+		});
+	}
+
+	std::thread writer([&]() {
+		ConversionJob* job;
+		while (writeQueue.pop(job))
+		{
+			if (job->converted)
+			{
+				StageTimer stageTimer{writeStatistics};
+
+				if (saveFile(job->glTF.dump(3), job->saveGltfName))
+				{
+					printf("Info: Saved glTF '%s'\n", job->saveGltfName.c_str());
+				}
+				else
+				{
+					printf("Error: Could not save generated glTF file '%s'\n", job->saveGltfName.c_str());
+
+					// The bin file is useless without its glTF.
+					std::error_code errorCode;
+					std::filesystem::remove(job->saveBinaryName, errorCode);
+
+					job->converted = false;
+				}
+			}
+
+			if (!job->converted)
+			{
+				failures++;
+			}
+
+			job->glTF = json();
+
+			slots.push(0);
+		}
+	});
+
+	reader.join();
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	writeQueue.close();
+	writer.join();
+
+	int64_t wallMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	printStageStatistics(readStatistics, wallMicroseconds);
+	printStageStatistics(convertStatistics, wallMicroseconds);
+	printStageStatistics(writeBinaryStatistics, wallMicroseconds);
+	printStageStatistics(writeStatistics, wallMicroseconds);
+
+	return failures;
+}
+
+//
+
+// Normalized path for detecting two names of the same file.
+std::string getPathKey(const std::string& filename)
+{
+	std::error_code errorCode;
+	std::filesystem::path path = std::filesystem::weakly_canonical(std::filesystem::absolute(filename), errorCode);
+	if (errorCode)
+	{
+		path = std::filesystem::absolute(filename).lexically_normal();
+	}
+
+	std::string key = path.string();
+#if defined(_WIN32)
+	// File names are not case sensitive.
+	std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+#endif
+
+	return key;
+}
+
+//
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> bvhFilenames;
+
+	size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+	size_t maxInFlight = 0;
+	float tolerance = 0.0f;
+	bool verbose = false;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && (i + 1 < argc))
+        {
+        	bvhFilenames.push_back(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i + 1 < argc))
+        {
+        	workerCount = (size_t)std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "-m") == 0 && (i + 1 < argc))
+        {
+        	maxInFlight = (size_t)std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+        	verbose = true;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && (i + 1 < argc))
+        {
+        	tolerance = std::max(0.0f, (float)atof(argv[i + 1]));
+        }
+    }
+
+    if (bvhFilenames.empty())
+    {
+    	bvhFilenames.push_back("Example1.bvh");
+    }
+
+    workerCount = std::min(workerCount, bvhFilenames.size());
+    // Details of several files at once would only be interleaved and slow the workers down.
+    if (bvhFilenames.size() == 1)
+    {
+    	verbose = true;
+    }
+    if (maxInFlight == 0)
+    {
+    	maxInFlight = 2 * workerCount;
+    }
+
+    //
+
+    std::vector<ConversionJob> jobs(bvhFilenames.size());
+    for (size_t i = 0; i < bvhFilenames.size(); i++)
+    {
+    	jobs[i].bvhFilename = bvhFilenames[i];
+
+    	if (bvhFilenames.size() == 1)
+    	{
+    		jobs[i].saveGltfName = "untitled.gltf";
+    		jobs[i].saveBinaryName = "untitled.bin";
+    	}
+    	else
+    	{
+    		// Several files are saved next to their BVH file.
+    		std::filesystem::path path(bvhFilenames[i]);
+    		jobs[i].saveGltfName = std::filesystem::path(path).replace_extension(".gltf").string();
+    		jobs[i].saveBinaryName = std::filesystem::path(path).replace_extension(".bin").string();
+    	}
+
+    	jobs[i].binaryUri = std::filesystem::path(jobs[i].saveBinaryName).filename().string();
+    }
+
+    // Two jobs writing the same file would corrupt both outputs, so every input and output path has to be unique.
+    std::set<std::string> usedPaths;
+    for (const auto& job : jobs)
+    {
+    	for (const std::string& filename : {job.bvhFilename, job.saveGltfName, job.saveBinaryName})
+    	{
+    		if (!usedPaths.insert(getPathKey(filename)).second)
+    		{
+    			printf("Error: File '%s' is used by more than one BVH file\n", filename.c_str());
+
+    			return -1;
+    		}
+    	}
+    }
+
+    if (convertAll(jobs, workerCount, maxInFlight, tolerance, verbose) > 0)
+    {
+    	return -1;
+    }
 
 	return 0;
 }